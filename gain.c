@@ -92,3 +92,54 @@ void refine_gain(_arg *arg){
   }
   return;
 }
+
+void drift_gain(_arg *arg){
+  // Map gain drift from residuals accumulated while packing
+  // rmsd - total drift, used - pixels measured, maxr - drifted, badp - new dead, ovfl - new hot
+  int32_t i, bad;
+  uint32_t cnt;
+  double dft;
+  for (i = arg->thrd; i < arg->size; i += arg->step){
+    bad = 0;
+    if (!isfinite(arg->gain[i]) || arg->gain[i] <= 0.0){
+      // Known bad pixels are not monitored
+      arg->resi[i] = 0.0;
+      if (arg->cand){
+	arg->cand[i] = arg->gain[i];
+      }
+      continue;
+    }
+    // Counts of overflowing frames carry no residual
+    cnt = arg->hits[i] - arg->sats[i];
+    dft = 0.0;
+    if (cnt >= HITS){
+      // Relative gain error from the refine_gain residual
+      dft = arg->resi[i] / (double) cnt;
+      arg->rmsd += fabs(dft);
+      arg->used++;
+      if (fabs(dft) > DRIFT){
+	arg->maxr++;
+      }
+    }
+    if (arg->mean >= BAD){
+      if (arg->hits[i] == 0){
+	arg->badp++;
+	bad = 1;
+	dft = -1.0;
+      } else if (arg->hits[i] > HOT * arg->mean){
+	arg->ovfl++;
+	bad = 1;
+      }
+    }
+    if (arg->cand){
+      if (bad){
+	// Negative gain of unchanged count scale - packed as before but counted bad
+	arg->cand[i] = -15.0 * arg->gain[i];
+      } else {
+	arg->cand[i] = arg->gain[i] * (1.0 + dft);
+      }
+    }
+    arg->resi[i] = dft;
+  }
+  return;
+}
@@ -29,10 +29,30 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#endif
 
 // Epsilon for bad pixels
 #define EPS 1E-6
 
+// Relative gain drift alert threshold and minimum counts to estimate it
+#define DRIFT 1E-3
+#define HITS  16
+
+// Multiple of mean counts over which a pixel is reported hot
+#define HOT 4
+
+// Mean counts before new dead or hot pixels are called - P(0) = e^-40
+#define BAD 40
+
 // Pack two integer data values into one byte as 4bit hex values
 #define PACK_BYTE(u , v) ((uint8_t)((( (uint8_t) u ) & 0x0f) | ((( (uint8_t) v ) & 0x0f) << 4)))
 
@@ -62,17 +82,54 @@ typedef struct {
   float        *buffer;
   float         *input;
   int8_t       *output;
+  float           *sum;
+  int16_t         *grp;
+  uint8_t      *packed;
+  uint8_t        *data;
+  size_t        length;
+  int32_t         hash;
+  uint32_t       crc_r;
+  uint32_t       crc_w;
+  int64_t      bytes_r;
+  int64_t      bytes_w;
+  int64_t      bytes_f;
   FILE           *file;
 } _mrc;
 
+// Header fields must fill the first 1024 bytes for checksums of the structure
+_Static_assert(offsetof(_mrc, buffer) == 1024, "MRC header fields are not contiguous");
+
+// Option structure
+typedef struct {
+  int64_t gsiz;
+  int32_t  sum;
+  int32_t  grp;
+  int32_t unpk;
+  int32_t frst;
+  int32_t last;
+  char   *mani;
+  int32_t drft;
+  char   *cand;
+  int32_t  bin;
+  int32_t bits;
+} _opt;
+
 // Thread argument structure
 typedef struct {
   _mrc    *mrc;
+  _opt    *opt;
   double *gain;
+  float  *scal;
+  float  *resi;
+  uint32_t *hits;
+  uint32_t *sats;
+  double *cand;
+  double  mean;
   double  rmsd;
   int64_t maxr;
   int64_t badp;
   int64_t ovfl;
+  int64_t used;
   int64_t cont;
   int64_t size;
   int32_t mode;
@@ -84,27 +141,39 @@ typedef struct {
 int thread_number(void);
 // Get thread number
 
-double *parse_args(int32_t *mode, int argc, char **argv);
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+// Update CRC32C checksum with data
+
+double *parse_args(int32_t *mode, _opt *opt, int argc, char **argv);
 // Read arguments and load gain
 
+void read_header(_mrc *mrc, FILE *file);
+// Read standard MRC header from file
+
 int read_mrc(_mrc *mrc, char* filename);
 // Read map header and fill mrc struct
 
-int write_mrc(_mrc* mrc, char *filename);
-// Writes 4-bit MRC file given an mrc file structure
+void write_header(_mrc *mrc, FILE *file);
+// Write standard MRC header to file
+
+int write_mrc(_mrc* mrc, _opt *opt, char *filename);
+// Writes 4-bit or binned 8-bit MRC file given an mrc file structure
 // Several header values are ignored to better speed
 
 void gain_mrc(double* gain, char *filename, int64_t size, _mrc* mrc);
 // Float Gain MRC file for convenience
 
+int write_map(_mrc *mrc, char *filename, void *data, int32_t mode, int32_t n_z);
+// Writes mode 1 or 2 MRC file of n_z sections sharing the stack header
+
 void read_frame(_mrc *mrc);
 // Read next frame from mrc file
 
 void close_mrc(_mrc *mrc);
 // Free header and data structures
 
-double *read_raw(char *filename);
-// Read raw gain reference in double
+double *read_raw(char *filename, int64_t *size);
+// Read raw gain reference in double and its pixel number
 
 void write_raw(double* gain, char *filename, int64_t size);
 // Writes 64-bit raw file given the double gain data
@@ -118,6 +187,10 @@ void refine_gain(_arg *arg);
 // Refine gain reference given frame
 // Thread function
 
+void drift_gain(_arg *arg);
+// Map gain drift from residuals accumulated while packing
+// Thread function
+
 void remove_gain(_arg *arg);
 // Remove gain reference from frame
 // Thread function
@@ -125,3 +198,17 @@ void remove_gain(_arg *arg);
 void pack_to_4bits(_arg *arg);
 // Pack integer images to 4-bit hex
 // Thread function
+
+void bin_frame(_arg *arg);
+// Bin integer images and pack to 4-bit hex or bytes
+// Thread function
+
+int unpack_mrc(_mrc *mrc, _arg *arg, int32_t n, char *file_r, char *file_w);
+// Unpack frame range of 4-bit MRC file to mode 0, 1 or 2 MRC file
+
+void unpack_frame(_arg *arg);
+// Unpack 4-bit hex frame to integer or gain-multiplied float image
+// Thread function
+
+void write_frame(_mrc *mrc);
+// Write last unpacked frame to mrc file
@@ -26,24 +26,36 @@ int main(int argc, char *argv[]){
   // Read stdin and estimate or refine gain, or convert image stacks to 4bit
 
   // Parameters
-  int32_t i, j, flag = 0, mode = 0;
+  int32_t i, j, n_x, n_y, n_grp, flag = 0, mode = 0, stck = 0, dflg;
   int64_t ovfl, badp, maxr, size = 0;
+  int64_t d_hot, d_dead, d_drft, d_used, k;
+  long double d_mean;
+  double hits;
+  uint32_t crc_g = 0;
   long double rmsd;
   double *gain = NULL;
   float *tmp;
+  FILE *manifest = NULL;
   _mrc mrc;
+  _opt opt;
   char file_r[1024];
   char file_w[1024];
 
   // Argument capture
-  gain = parse_args(&mode, argc, argv);
+  gain = parse_args(&mode, &opt, argc, argv);
 
   // Thread setup
   int n = thread_number();
   _arg arg[n];
   for(i = 0; i < n; i++){
     arg[i].mrc  = &mrc;
+    arg[i].opt  = &opt;
     arg[i].gain = gain;
+    arg[i].scal = NULL;
+    arg[i].resi = NULL;
+    arg[i].hits = NULL;
+    arg[i].sats = NULL;
+    arg[i].cand = NULL;
     arg[i].thrd = i;
     arg[i].step = n;
     arg[i].cont = 0;
@@ -53,22 +65,83 @@ int main(int argc, char *argv[]){
   mrc.input  = NULL;
   mrc.buffer = NULL;
   mrc.output = NULL;
+  mrc.sum    = NULL;
+  mrc.grp    = NULL;
+  mrc.packed = NULL;
+  mrc.file   = NULL;
+  mrc.hash   = 0;
+
+  // Session manifest if required
+  if (!mode && opt.mani){
+    manifest = fopen(opt.mani, "w");
+    if (!manifest){
+      printf("\n\t Error writing %s - bad file handle\n", opt.mani);
+      exit(1);
+    }
+    fprintf(manifest, "# Input\tBytes\tCRC32C\tOutput\tBytes\tCRC32C\tX\tY\tZ\tGainCRC32C\tMeanDev\tErrPix\tBadPix\tOverflows\tStatus\n");
+    mrc.hash = 1;
+  }
   
   // Scan stdin and feed files to function
   printf("\n");
   while (scanf("%1019s", file_r) == 1 && !feof(stdin)){
 
+    // Unpack 4bit stacks if required
+    if (mode < 0){
+      snprintf(file_w, 1023, "%s%s", file_r, ".mrc");
+      if (unpack_mrc(&mrc, arg, n, file_r, file_w)){
+	printf(" - Error unpacking %s!\n", file_r);
+      } else {
+	printf(" -> unpacked \n");
+      }
+      close_mrc(&mrc);
+      continue;
+    }
+
     // Read and check file
     if(read_mrc(&mrc, file_r)){
       printf("\n\t MRC file %s not found!\n", file_r);
       close_mrc(&mrc);
       continue;
     }
+    if (!mode && (int64_t) mrc.n_crs[0] * mrc.n_crs[1] != opt.gsiz){
+      printf("\n\t MRC file %s does not match gain size!\n", file_r);
+      close_mrc(&mrc);
+      continue;
+    }
+    if (!mode && (opt.bin > mrc.n_crs[0] || opt.bin > mrc.n_crs[1])){
+      printf("\n\t MRC file %s smaller than bin!\n", file_r);
+      close_mrc(&mrc);
+      continue;
+    }
     if (size == 0){
       size = mrc.n_crs[0] * mrc.n_crs[1];
       for(i = 0; i < n; i++){
 	arg[i].size = size;
       }
+      // Checksum of gain as stored in gain.raw
+      if (manifest){
+	crc_g = crc32c(0, &size, sizeof(int64_t));
+	crc_g = crc32c(crc_g, gain, size * sizeof(double));
+      }
+      // Residual accumulators for gain drift monitoring
+      if (!mode && opt.drft){
+	arg[0].resi = calloc(size, sizeof(float));
+	arg[0].hits = calloc(size, sizeof(uint32_t));
+	arg[0].sats = calloc(size, sizeof(uint32_t));
+	arg[0].cand = (opt.cand ? malloc(size * sizeof(double)) : NULL);
+	if (!arg[0].resi || !arg[0].hits || !arg[0].sats || (opt.cand && !arg[0].cand)){
+	  printf("\n\t Memory allocation failed!\n");
+	  fflush(stdout);
+	  exit(1);
+	}
+	for(i = 1; i < n; i++){
+	  arg[i].resi = arg[0].resi;
+	  arg[i].hits = arg[0].hits;
+	  arg[i].sats = arg[0].sats;
+	  arg[i].cand = arg[0].cand;
+	}
+      }
     } else if (mrc.n_crs[0] * mrc.n_crs[1] != size){
       printf("\n\t MRC file %s incorrect size!\n", file_r);
       close_mrc(&mrc);
@@ -86,6 +159,19 @@ int main(int argc, char *argv[]){
 	}
       }
     }
+    // Frame sum accumulators if required
+    n_grp = (opt.grp ? (mrc.n_crs[2] + opt.grp - 1) / opt.grp : 0);
+    if (!mode && opt.sum){
+      mrc.sum = calloc(size, sizeof(float));
+    }
+    if (!mode && opt.grp){
+      mrc.grp = calloc(size * n_grp, sizeof(int16_t));
+    }
+    if ((!mode && opt.sum && !mrc.sum) || (!mode && opt.grp && !mrc.grp)){
+      printf("\n\t Memory allocation failed!\n");
+      fflush(stdout);
+      exit(1);
+    }
     printf("\t %s -> #", file_r);
     fflush(stdout);
 
@@ -153,7 +239,8 @@ int main(int argc, char *argv[]){
       // Pack if necessary
       if (!mode){
 	for (i = 0; i < n; i++){
-	  if (pthread_create(&threads[i], NULL, (void*) pack_to_4bits, &arg[i])){
+	  arg[i].ovfl = 0;
+	  if (pthread_create(&threads[i], NULL, (void*) (opt.bin > 1 ? bin_frame : pack_to_4bits), &arg[i])){
 	    printf("\n\t Thread initialisation failed!\n");
 	    fflush(stdout);
 	    exit(1);
@@ -165,6 +252,7 @@ int main(int argc, char *argv[]){
 	    fflush(stdout);
 	    exit(1);
 	  }
+	  ovfl += arg[i].ovfl;
 	}
       }
 
@@ -175,15 +263,99 @@ int main(int argc, char *argv[]){
       fflush(stdout);
     }
 
+    // Write out frame sums if required
+    if(!mode && mrc.sum){
+      snprintf(file_w, 1023, "%s%s", file_r, "sum.mrc");
+      if (write_map(&mrc, file_w, mrc.sum, 2, 1)){
+	printf(" - Error writing %s!", file_w);
+      } else {
+	printf(" -> sum ");
+      }
+    }
+    if(!mode && mrc.grp){
+      snprintf(file_w, 1023, "%s%s", file_r, "grp.mrc");
+      if (write_map(&mrc, file_w, mrc.grp, 1, n_grp)){
+	printf(" - Error writing %s!", file_w);
+      } else {
+	printf(" -> grp ");
+      }
+    }
+
+    // Map gain drift every few stacks if required
+    dflg = 0;
+    if(!mode && opt.drft && ++stck % opt.drft == 0){
+      hits = 0.0;
+      k = 0;
+      for (i = 0; i < size; i++){
+	if (isfinite(gain[i]) && gain[i] > 0.0){
+	  hits += arg[0].hits[i];
+	  k++;
+	}
+      }
+      for (i = 0; i < n; i++){
+	arg[i].mean = (k ? hits / (double) k : 0.0);
+	arg[i].rmsd = 0.0;
+	arg[i].used =   0;
+	arg[i].maxr =   0;
+	arg[i].badp =   0;
+	arg[i].ovfl =   0;
+	if (pthread_create(&threads[i], NULL, (void*) drift_gain, &arg[i])){
+	  printf("\n\t Thread initialisation failed!\n");
+	  fflush(stdout);
+	  exit(1);
+	}
+      }
+      d_mean = 0.0;
+      d_used =   0;
+      d_drft =   0;
+      d_dead =   0;
+      d_hot  =   0;
+      for (i = 0; i < n; i++){
+	if (pthread_join(threads[i], NULL)){
+	  printf("\n\t Thread failed during run!\n");
+	  fflush(stdout);
+	  exit(1);
+	}
+	d_mean += arg[i].rmsd;
+	d_used += arg[i].used;
+	d_drft += arg[i].maxr;
+	d_dead += arg[i].badp;
+	d_hot  += arg[i].ovfl;
+      }
+      d_mean /= (long double) (d_used ? d_used : 1);
+      if (write_map(&mrc, "drift.mrc", arg[0].resi, 2, 1)){
+	printf(" - Error writing drift.mrc!");
+      }
+      if (opt.cand){
+	write_raw(arg[0].cand, opt.cand, size);
+      }
+      memset(arg[0].resi, 0, size * sizeof(float));
+      memset(arg[0].hits, 0, size * sizeof(uint32_t));
+      memset(arg[0].sats, 0, size * sizeof(uint32_t));
+      dflg = 1;
+    }
+
+    // Convenience gain mrc - before the header is rewritten for output
+    if(!mode && !flag){
+      gain_mrc(gain, "gain.mrc", size, &mrc);
+      flag++;
+    }
+
     // Write out 4bit packed stacks if required
+    n_x = mrc.n_crs[0];
+    n_y = mrc.n_crs[1];
     if(!mode){
-      snprintf(file_w, 1023, "%s%s", file_r, "4bit");
-      if (write_mrc(&mrc, file_w)){
+      snprintf(file_w, 1023, "%s%s", file_r, (opt.bits == 8 ? "8bit" : "4bit"));
+      if (write_mrc(&mrc, &opt, file_w)){
 	printf(" - Error writing %s!\n", file_w);
+	if (manifest){
+	  fprintf(manifest, "%s\t%lli\t%08x\t%s\t-\t-\t%i\t%i\t%i\t%08x\t-\t-\t-\t-\tWRITE_ERROR\n", file_r, (long long) mrc.bytes_r, (unsigned) mrc.crc_r, file_w, n_x, n_y, mrc.n_crs[2], (unsigned) crc_g);
+	  fflush(manifest);
+	}
 	close_mrc(&mrc);
 	continue;
       }
-      printf(" -> 4bit ");
+      printf(" -> %s ", (opt.bits == 8 ? "8bit" : "4bit"));
     }
 
     // Report results to user
@@ -191,11 +363,23 @@ int main(int argc, char *argv[]){
     printf("\n\t MeanDev %12.3Lg   |   ErrPix %12lli   |   BadPix %12lli   |   Overflows %12lli   |   TotalPix %10lli\n", rmsd, badp, maxr, ovfl, size * mrc.n_crs[2]);
     fflush(stdout);
 
-    // Convenience gain mrc
-    if(!mode && !flag){
-      gain_mrc(gain, "gain.mrc", size, &mrc);
-      flag++;
-    } else if (mode == 1 && arg[0].cont >= 256){
+    // Report gain drift to user
+    if (dflg){
+      printf("\t DriftDev %11.3Lg   |   Drifted %11lli   |   NewDead %11lli   |   NewHot %13lli   |   Stacks %12i\n", d_mean, (long long) d_drft, (long long) d_dead, (long long) d_hot, opt.drft);
+      if (d_drft || d_dead || d_hot){
+	printf("\t !!!! Gain drift detected - check drift.mrc%s%s !!!!\n", (opt.cand ? " and " : ""), (opt.cand ? opt.cand : ""));
+      }
+      fflush(stdout);
+    }
+
+    // Record checksums and statistics in manifest
+    if (manifest){
+      fprintf(manifest, "%s\t%lli\t%08x\t%s\t%lli\t%08x\t%i\t%i\t%i\t%08x\t%.3Lg\t%lli\t%lli\t%lli\t%s\n", file_r, (long long) mrc.bytes_r, (unsigned) mrc.crc_r, file_w, (long long) mrc.bytes_w, (unsigned) mrc.crc_w, n_x, n_y, mrc.n_crs[2], (unsigned) crc_g, rmsd, (long long) badp, (long long) maxr, (long long) ovfl, (mrc.bytes_r == mrc.bytes_f ? "OK" : "PARTIAL_INPUT"));
+      fflush(manifest);
+    }
+
+    // Switch from estimation to refinement of gain
+    if (mode == 1 && arg[0].cont >= 256){
       mode++;
       flag++;
     }
@@ -207,6 +391,10 @@ int main(int argc, char *argv[]){
     }
   }
 
+  if (manifest){
+    fclose(manifest);
+  }
+
   // Over and out
   printf("\n\t ++++ That's all folks! ++++ \n\n");
   return 0;
@@ -39,6 +39,15 @@ void remove_gain(_arg *arg){
     } else {
       cur = round(arg->mrc->input[i] / arg->gain[i]);
       dev = cur - (arg->mrc->input[i] / arg->gain[i]);
+      if (arg->resi){
+	// Residual against integer counts for drift monitoring
+	arg->hits[i] += cur;
+	if (cur <= 15){
+	  arg->resi[i] -= dev;
+	} else {
+	  arg->sats[i] += cur;
+	}
+      }
       if (cur > 15){
 	arg->ovfl++;
 	cur = 15;
@@ -52,16 +61,24 @@ void remove_gain(_arg *arg){
       arg->maxr++;
     }
     arg->mrc->input[i] = cur;
+    // Accumulate frame sums while the integer frame is in cache
+    if (arg->mrc->sum){
+      arg->mrc->sum[i] += cur;
+    }
+    if (arg->mrc->grp){
+      arg->mrc->grp[(int64_t) (arg->fram / arg->opt->grp) * arg->size + i] += cur;
+    }
   }
   return;
 }
 
 void pack_to_4bits(_arg *arg){
   // Pack integer images to 4-bit hex
-  int32_t i, j, in_p, int_p, out_p;
+  int32_t i, j, in_p, int_p;
+  int64_t out_p;
   int32_t dim_4b0 = (arg->mrc->n_crs[0] / 2) + (arg->mrc->n_crs[0] % 2);
   for(j = 0; j < arg->mrc->n_crs[1]; j++){
-    out_p = arg->fram * dim_4b0 * arg->mrc->n_crs[1] + j * dim_4b0;
+    out_p = ((int64_t) arg->fram * arg->mrc->n_crs[1] + j) * dim_4b0;
     int_p = j * arg->mrc->n_crs[0];
     for(i = arg->thrd; i < dim_4b0; i += arg->step){
       in_p = int_p + 2 * i;
@@ -70,3 +87,56 @@ void pack_to_4bits(_arg *arg){
   }
   return;
 }
+
+static int32_t bin_pixel(_arg *arg, int32_t i, int32_t j){
+  // Sum integer counts over bin by bin block
+  int32_t k, l, sum = 0;
+  int32_t bin = arg->opt->bin;
+  float *row;
+  for (l = 0; l < bin; l++){
+    row = arg->mrc->input + (int64_t) (j * bin + l) * arg->mrc->n_crs[0] + i * bin;
+    for (k = 0; k < bin; k++){
+      sum += row[k];
+    }
+  }
+  return sum;
+}
+
+void bin_frame(_arg *arg){
+  // Bin integer images and pack to 4-bit hex or bytes
+  // Edge pixels beyond a whole bin are cropped
+  int32_t i, j, cur[2];
+  int32_t n_x = arg->mrc->n_crs[0] / arg->opt->bin;
+  int32_t n_y = arg->mrc->n_crs[1] / arg->opt->bin;
+  int32_t dim_4b0 = (n_x / 2) + (n_x % 2);
+  int64_t out_p;
+  for (j = arg->thrd; j < n_y; j += arg->step){
+    if (arg->opt->bits == 8){
+      out_p = ((int64_t) arg->fram * n_y + j) * n_x;
+      for (i = 0; i < n_x; i++){
+	cur[0] = bin_pixel(arg, i, j);
+	if (cur[0] > 127){
+	  arg->ovfl++;
+	  cur[0] = 127;
+	}
+	arg->mrc->output[out_p + i] = cur[0];
+      }
+    } else {
+      out_p = ((int64_t) arg->fram * n_y + j) * dim_4b0;
+      for (i = 0; i < dim_4b0; i++){
+	cur[0] = bin_pixel(arg, 2 * i, j);
+	cur[1] = (2 * i + 1 < n_x ? bin_pixel(arg, 2 * i + 1, j) : 0);
+	if (cur[0] > 15){
+	  arg->ovfl++;
+	  cur[0] = 15;
+	}
+	if (cur[1] > 15){
+	  arg->ovfl++;
+	  cur[1] = 15;
+	}
+	arg->mrc->output[out_p + i] = PACK_BYTE(cur[0], cur[1]);
+      }
+    }
+  }
+  return;
+}
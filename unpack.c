@@ -0,0 +1,239 @@
+
+/*                                                                         
+ * Copyright 27/11/2018 - Dr. Christopher H. S. Aylett                     
+ *                                                                         
+ * This program is free software; you can redistribute it and/or modify    
+ * it under the terms of version 3 of the GNU General Public License as    
+ * published by the Free Software Foundation.                              
+ *                                                                         
+ * This program is distributed in the hope that it will be useful,         
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           
+ * GNU General Public License for more details - YOU HAVE BEEN WARNED!     
+ *                                                                         
+ * Program: K2 bit packer V1.1                                             
+ *                                                                         
+ * Authors: Chris Aylett                                                   
+ *                                                                         
+ */
+
+// Library header inclusion for linking                                     
+#include "head.h"
+
+int unpack_mrc(_mrc *mrc, _arg *arg, int32_t n, char *file_r, char *file_w){
+  // Unpack frame range of memory mapped 4-bit MRC file to mode 0, 1 or 2
+  int32_t i, k, first, last, dim_4b0;
+  int64_t size, bytes, ext;
+  struct stat st;
+  pthread_t threads[n];
+  pthread_t frame_thread;
+  float *tmp;
+  _opt *opt = arg[0].opt;
+  // Read header and map data
+  mrc->file = fopen(file_r, "rb");
+  if (!mrc->file){
+    printf("\t Error reading %s - bad file handle\n", file_r);
+    return 1;
+  }
+  read_header(mrc, mrc->file);
+  fclose(mrc->file);
+  mrc->file = NULL;
+  if (mrc->mode != 101 || mrc->n_crs[0] <= 0 || mrc->n_crs[1] <= 0 || mrc->n_crs[2] <= 0){
+    printf("\t Error reading %s - not a 4-bit mrc file of this endianness\n", file_r);
+    return 1;
+  }
+  dim_4b0 = (mrc->n_crs[0] / 2) + (mrc->n_crs[0] % 2);
+  size = (int64_t) mrc->n_crs[0] * mrc->n_crs[1];
+  bytes = (int64_t) dim_4b0 * mrc->n_crs[1] * mrc->n_crs[2];
+  i = open(file_r, O_RDONLY);
+  if (i < 0 || fstat(i, &st)){
+    printf("\t Error reading %s - bad file handle\n", file_r);
+    if (i >= 0){
+      close(i);
+    }
+    return 1;
+  }
+  // Earlier packers copied nsymbt without writing the extended header
+  ext = ((int64_t) st.st_size == 1024 + bytes ? 0 : mrc->nsymbt);
+  if (ext < 0 || (int64_t) st.st_size < 1024 + ext + bytes){
+    printf("\t Error reading %s - file truncated\n", file_r);
+    if (i >= 0){
+      close(i);
+    }
+    return 1;
+  }
+  mrc->length = st.st_size;
+  mrc->packed = mmap(NULL, mrc->length, PROT_READ, MAP_PRIVATE, i, 0);
+  close(i);
+  if (mrc->packed == MAP_FAILED){
+    mrc->packed = NULL;
+    printf("\t Error reading %s - memory map failed\n", file_r);
+    return 1;
+  }
+  mrc->data = mrc->packed + 1024 + ext;
+  // Frames are of fixed size so any frame can be reached directly
+  first = opt->frst;
+  last  = (opt->last < 0 || opt->last >= mrc->n_crs[2] ? mrc->n_crs[2] - 1 : opt->last);
+  if (first < 0 || first > last){
+    printf("\t Error reading %s - frames %i to %i not in stack\n", file_r, first, last);
+    return 1;
+  }
+  if (opt->unpk == 2 && size != opt->gsiz){
+    printf("\t Error reading %s - stack does not match gain size\n", file_r);
+    return 1;
+  }
+  // Float gain multipliers as for the convenience gain mrc
+  if (opt->unpk == 2 && arg[0].scal == NULL){
+    tmp = malloc(opt->gsiz * sizeof(float));
+    if (!tmp){
+      printf("\n\t Memory allocation failed!\n");
+      fflush(stdout);
+      exit(1);
+    }
+    for (k = 0; k < opt->gsiz; k++){
+      if (!isfinite((float) arg[0].gain[k]) || (float) arg[0].gain[k] == 0.0){
+	tmp[k] = 1.0;
+      } else if (arg[0].gain[k] < 0.0){
+	tmp[k] = (float) arg[0].gain[k] / -15.0;
+      } else {
+	tmp[k] = (float) arg[0].gain[k];
+      }
+    }
+    for (i = 0; i < n; i++){
+      arg[i].scal = tmp;
+    }
+  }
+  mrc->input  = malloc(size * sizeof(float));
+  mrc->buffer = malloc(size * sizeof(float));
+  if(!mrc->input || !mrc->buffer){
+    printf("\t Error reading %s - no memory allocated\n", file_r);
+    return 1;
+  }
+  // Output header - values are set to placeholders for speed
+  mrc->length_xyz[2] = (last - first + 1) * (mrc->length_xyz[2] / ((float) mrc->n_xyz[2]));
+  mrc->n_crs[2] = last - first + 1;
+  mrc->n_xyz[2] = last - first + 1;
+  mrc->mode     = opt->unpk;
+  mrc->nsymbt   =    0;
+  mrc->d_min    =  0.0;
+  mrc->d_max    = 16.0;
+  mrc->d_mean   =  1.0;
+  mrc->rms      =  4.0;
+  mrc->file = fopen(file_w, "wb");
+  if (!mrc->file){
+    fprintf(stderr, "\n\t Error writing output - bad file handle\n");
+    return 1;
+  }
+  write_header(mrc, mrc->file);
+  printf("\t %s -> #", file_r);
+  fflush(stdout);
+  // Unpack each frame while the last is written
+  for (k = first; k <= last; k++){
+    for (i = 0; i < n; i++){
+      arg[i].fram = k;
+      if (pthread_create(&threads[i], NULL, (void*) unpack_frame, &arg[i])){
+	printf("\n\t Thread initialisation failed!\n");
+	fflush(stdout);
+	exit(1);
+      }
+    }
+    for (i = 0; i < n; i++){
+      if (pthread_join(threads[i], NULL)){
+	printf("\n\t Thread failed during run!\n");
+	fflush(stdout);
+	exit(1);
+      }
+    }
+    if (k > first && pthread_join(frame_thread, NULL)){
+      printf("\n\t Thread failed during run!\n");
+      fflush(stdout);
+      exit(1);
+    }
+    tmp = mrc->input;
+    mrc->input = mrc->buffer;
+    mrc->buffer = tmp;
+    if (pthread_create(&frame_thread, NULL, (void*) write_frame, mrc)){
+      printf("\n\t Thread initialisation failed!\n");
+      fflush(stdout);
+      exit(1);
+    }
+    printf("#");
+    fflush(stdout);
+  }
+  if (pthread_join(frame_thread, NULL)){
+    printf("\n\t Thread failed during run!\n");
+    fflush(stdout);
+    exit(1);
+  }
+  return ferror(mrc->file);
+}
+
+void unpack_frame(_arg *arg){
+  // Unpack 4-bit hex rows to integer or gain-multiplied float image
+  int32_t i, j, p, nx = arg->mrc->n_crs[0];
+  int32_t dim_4b0 = (nx / 2) + (nx % 2);
+  int64_t in_p, out_p;
+  uint8_t *in, cur;
+#ifdef __SSE2__
+  int32_t l;
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v, lo, hi, pix[2], wrd[4];
+#endif
+  for (j = arg->thrd; j < arg->mrc->n_crs[1]; j += arg->step){
+    in_p  = ((int64_t) arg->fram * arg->mrc->n_crs[1] + j) * dim_4b0;
+    out_p = (int64_t) j * nx;
+    in = arg->mrc->data + in_p;
+    i = 0;
+#ifdef __SSE2__
+    // Split sixteen bytes to thirty-two nibbles in pixel order
+    for (; 2 * i + 32 <= nx; i += 16){
+      v  = _mm_loadu_si128((const __m128i*) (in + i));
+      lo = _mm_and_si128(v, mask);
+      hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+      pix[0] = _mm_unpacklo_epi8(lo, hi);
+      pix[1] = _mm_unpackhi_epi8(lo, hi);
+      if (arg->opt->unpk == 0){
+	_mm_storeu_si128((__m128i*) ((uint8_t*) arg->mrc->input + out_p + 2 * i),      pix[0]);
+	_mm_storeu_si128((__m128i*) ((uint8_t*) arg->mrc->input + out_p + 2 * i + 16), pix[1]);
+	continue;
+      }
+      wrd[0] = _mm_unpacklo_epi8(pix[0], zero);
+      wrd[1] = _mm_unpackhi_epi8(pix[0], zero);
+      wrd[2] = _mm_unpacklo_epi8(pix[1], zero);
+      wrd[3] = _mm_unpackhi_epi8(pix[1], zero);
+      for (l = 0; l < 4; l++){
+	if (arg->opt->unpk == 1){
+	  _mm_storeu_si128((__m128i*) ((int16_t*) arg->mrc->input + out_p + 2 * i + 8 * l), wrd[l]);
+	} else {
+	  _mm_storeu_ps(arg->mrc->input + out_p + 2 * i + 8 * l,
+			_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(wrd[l], zero)),
+				   _mm_loadu_ps(arg->scal + out_p + 2 * i + 8 * l)));
+	  _mm_storeu_ps(arg->mrc->input + out_p + 2 * i + 8 * l + 4,
+			_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(wrd[l], zero)),
+				   _mm_loadu_ps(arg->scal + out_p + 2 * i + 8 * l + 4)));
+	}
+      }
+    }
+#endif
+    // Remaining pixels - the high nibble of an odd final byte is padding
+    for (p = 2 * i; p < nx; p++){
+      cur = (p % 2 ? in[p / 2] >> 4 : in[p / 2] & 0x0f);
+      if (arg->opt->unpk == 0){
+	((uint8_t*) arg->mrc->input)[out_p + p] = cur;
+      } else if (arg->opt->unpk == 1){
+	((int16_t*) arg->mrc->input)[out_p + p] = cur;
+      } else {
+	arg->mrc->input[out_p + p] = cur * arg->scal[out_p + p];
+      }
+    }
+  }
+  return;
+}
+
+void write_frame(_mrc *mrc){
+  // Write last unpacked frame to mrc file
+  size_t bytes = (mrc->mode == 0 ? sizeof(uint8_t) : (mrc->mode == 1 ? sizeof(int16_t) : sizeof(float)));
+  fwrite(mrc->buffer, bytes, (size_t) mrc->n_crs[0] * mrc->n_crs[1], mrc->file);
+  return;
+}
@@ -41,26 +41,136 @@ int thread_number(void){
   return n;
 }
 
-double *parse_args(int32_t *mode, int argc, char **argv){
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t size){
+  // CRC32C by SSE4.2 instruction - eight bytes at a time
+  uint64_t cur, crc_64 = crc;
+  for (; size >= 8; size -= 8, data += 8){
+    memcpy(&cur, data, 8);
+    crc_64 = _mm_crc32_u64(crc_64, cur);
+  }
+  crc = (uint32_t) crc_64;
+  for (; size > 0; size--, data++){
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size){
+  // Update CRC32C (Castagnoli) checksum as used by iSCSI and ext4
+  static uint32_t table[256];
+  static int32_t hard = -1;
+  const uint8_t *cur = data;
+  uint32_t i, j, val;
+  if (hard < 0){
+    // Table for machines without hardware support - called first from main thread
+    for (i = 0; i < 256; i++){
+      val = i;
+      for (j = 0; j < 8; j++){
+	val = (val >> 1) ^ (val & 1 ? 0x82F63B78 : 0);
+      }
+      table[i] = val;
+    }
+    hard = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    hard = __builtin_cpu_supports("sse4.2");
+#endif
+  }
+  crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (hard){
+    return ~crc32c_sse42(crc, cur, size);
+  }
+#endif
+  for (; size > 0; size--, cur++){
+    crc = (crc >> 8) ^ table[(crc ^ *cur) & 0xff];
+  }
+  return ~crc;
+}
+
+double *parse_args(int32_t *mode, _opt *opt, int argc, char **argv){
   // Capture user requested settings
   int i;
   double *gain = NULL;
+  opt->sum  =  0;
+  opt->grp  =  0;
+  opt->gsiz =  0;
+  opt->unpk =  0;
+  opt->frst =  0;
+  opt->last = -1;
+  opt->mani = NULL;
+  opt->drft =    0;
+  opt->cand = NULL;
+  opt->bin  =    1;
+  opt->bits =    0;
   for (i = 1; i < argc; i++){
     if (!strcmp(argv[i], "--gain")){
      *mode = 1;
     } else if (!strcmp(argv[i], "--pack") && ((i + 1) < argc)){
      *mode = 0;
-      gain = read_raw(argv[i + 1]);
+      gain = read_raw(argv[i + 1], &opt->gsiz);
+    } else if (!strcmp(argv[i], "--sum")){
+      opt->sum = 1;
+    } else if (!strcmp(argv[i], "--group") && ((i + 1) < argc)){
+      opt->grp = atoi(argv[i + 1]);
+    } else if (!strcmp(argv[i], "--unpack") && ((i + 1) < argc)){
+     *mode = -1;
+      opt->unpk = atoi(argv[i + 1]);
+      if (opt->unpk == 2 && ((i + 2) < argc)){
+	gain = read_raw(argv[i + 2], &opt->gsiz);
+      }
+    } else if (!strcmp(argv[i], "--drift") && ((i + 1) < argc)){
+      opt->drft = atoi(argv[i + 1]);
+    } else if (!strcmp(argv[i], "--candidate") && ((i + 1) < argc)){
+      opt->cand = argv[i + 1];
+    } else if (!strcmp(argv[i], "--bin") && ((i + 1) < argc)){
+      opt->bin = atoi(argv[i + 1]);
+    } else if (!strcmp(argv[i], "--bits") && ((i + 1) < argc)){
+      opt->bits = atoi(argv[i + 1]);
+    } else if (!strcmp(argv[i], "--manifest") && ((i + 1) < argc)){
+      opt->mani = argv[i + 1];
+    } else if (!strcmp(argv[i], "--frames") && ((i + 2) < argc)){
+      opt->frst = atoi(argv[i + 1]);
+      opt->last = atoi(argv[i + 2]);
     }
   }
-  if (gain == NULL && !*mode){
+  if (!opt->bits){
+    // Binned counts exceed 4 bits so default to bytes
+    opt->bits = (opt->bin > 1 ? 8 : 4);
+  }
+  if ((gain == NULL && !*mode) || opt->bin < 1 || (opt->bits != 4 && opt->bits != 8) || (opt->bits == 8 && opt->bin < 2) || opt->grp < 0 || opt->drft < 0 || (opt->cand && !opt->drft) || opt->unpk < 0 || opt->unpk > 2 || (gain == NULL && opt->unpk == 2)){
     // Print usage and disclaimer
-    printf("\n\t Usage - (list_of_mrc_stacks) | %s [ --gain ][ --pack gain.raw ] \n\n", argv[0]);
+    printf("\n\t Usage - (list_of_mrc_stacks) | %s [ --gain ][ --pack gain.raw [ --sum ][ --group n ][ --manifest file ][ --drift n [ --candidate gain.raw ] ][ --bin n [ --bits 4|8 ] ] ][ --unpack 0|1|2 [ gain.raw ] [ --frames first last ] ] \n\n", argv[0]);
     exit(1);
   }
   return gain;
 }
 
+void read_header(_mrc *mrc, FILE *file){
+  // Read standard MRC header fields from file
+  fread(&mrc->n_crs,      4, 3,   file);
+  fread(&mrc->mode,       4, 1,   file);
+  fread(&mrc->start_crs,  4, 3,   file);
+  fread(&mrc->n_xyz,      4, 3,   file);
+  fread(&mrc->length_xyz, 4, 3,   file);
+  fread(&mrc->angle_xyz,  4, 3,   file);
+  fread(&mrc->map_crs,    4, 3,   file);
+  fread(&mrc->d_min,      4, 1,   file);
+  fread(&mrc->d_max,      4, 1,   file);
+  fread(&mrc->d_mean,     4, 1,   file);
+  fread(&mrc->ispg,       4, 1,   file);
+  fread(&mrc->nsymbt,     4, 1,   file);
+  fread(&mrc->extra,      4, 25,  file);
+  fread(&mrc->ori_xyz,    4, 3,   file);
+  fread(&mrc->map,        1, 4,   file);
+  fread(&mrc->machst,     1, 4,   file);
+  fread(&mrc->rms,        4, 1,   file);
+  fread(&mrc->nlabl,      4, 1,   file);
+  fread(&mrc->label,      1, 800, file);
+  return;
+}
+
 int read_mrc(_mrc *mrc, char* filename){
   // Read map header and data and return corresponding data structure
   if (!mrc){
@@ -73,25 +183,7 @@ int read_mrc(_mrc *mrc, char* filename){
     fclose(mrc->file);
     return 1;
   }
-  fread(&mrc->n_crs,      4, 3,   mrc->file);
-  fread(&mrc->mode,       4, 1,   mrc->file);
-  fread(&mrc->start_crs,  4, 3,   mrc->file);
-  fread(&mrc->n_xyz,      4, 3,   mrc->file);
-  fread(&mrc->length_xyz, 4, 3,   mrc->file);
-  fread(&mrc->angle_xyz,  4, 3,   mrc->file);
-  fread(&mrc->map_crs,    4, 3,   mrc->file);
-  fread(&mrc->d_min,      4, 1,   mrc->file);
-  fread(&mrc->d_max,      4, 1,   mrc->file);
-  fread(&mrc->d_mean,     4, 1,   mrc->file);
-  fread(&mrc->ispg,       4, 1,   mrc->file);
-  fread(&mrc->nsymbt,     4, 1,   mrc->file);
-  fread(&mrc->extra,      4, 25,  mrc->file);
-  fread(&mrc->ori_xyz,    4, 3,   mrc->file);
-  fread(&mrc->map,        1, 4,   mrc->file);
-  fread(&mrc->machst,     1, 4,   mrc->file);
-  fread(&mrc->rms,        4, 1,   mrc->file);
-  fread(&mrc->nlabl,      4, 1,   mrc->file);
-  fread(&mrc->label,      1, 800, mrc->file);
+  read_header(mrc, mrc->file);
   /* Assign 8 bit int array for data, initialize it to zero and read frame 0. Note that
      the endianness is not corrected: architectures may therefore be cross-incompatible */
   if(mrc->n_crs[0] <= 0 || mrc->n_crs[1] <= 0 || mrc->n_crs[2] <= 0){
@@ -105,18 +197,31 @@ int read_mrc(_mrc *mrc, char* filename){
   }
   mrc->input  = malloc(mrc->n_crs[0] * mrc->n_crs[1] * sizeof(float));
   mrc->buffer = malloc(mrc->n_crs[0] * mrc->n_crs[1] * sizeof(float));
-  mrc->output = calloc(dim_4b0 * mrc->n_crs[1] * mrc->n_crs[2], sizeof(int8_t));
+  // Also large enough for 8-bit output binned by at least two
+  mrc->output = calloc((size_t) dim_4b0 * mrc->n_crs[1] * mrc->n_crs[2], sizeof(int8_t));
   if(!mrc->input || !mrc->buffer || !mrc->output){
     printf("\t Error reading %s - no memory allocated\n", filename);
     return 1;
   }
-  fread(mrc->input, sizeof(float), mrc->n_crs[0] * mrc->n_crs[1], mrc->file);
+  size_t n_read = fread(mrc->input, sizeof(float), mrc->n_crs[0] * mrc->n_crs[1], mrc->file);
+  // Checksum bytes as read - the header fields are contiguous in the structure
+  if (mrc->hash){
+    struct stat st;
+    mrc->bytes_f = (stat(filename, &st) ? -1 : (int64_t) st.st_size);
+    mrc->crc_r   = crc32c(0, mrc, 1024);
+    mrc->crc_r   = crc32c(mrc->crc_r, mrc->input, n_read * sizeof(float));
+    mrc->bytes_r = 1024 + n_read * sizeof(float);
+  }
   return 0;
 }
 
 void read_frame(_mrc *mrc){
   // Read next frame from mrc file
-  fread(mrc->buffer, sizeof(float), mrc->n_crs[0] * mrc->n_crs[1], mrc->file);
+  size_t n_read = fread(mrc->buffer, sizeof(float), mrc->n_crs[0] * mrc->n_crs[1], mrc->file);
+  if (mrc->hash){
+    mrc->crc_r    = crc32c(mrc->crc_r, mrc->buffer, n_read * sizeof(float));
+    mrc->bytes_r += n_read * sizeof(float);
+  }
   return;
 }
 
@@ -124,29 +229,79 @@ void close_mrc(_mrc *mrc){
   // Free header and data structures
   if (mrc->file){
     fclose(mrc->file);
+    mrc->file = NULL;
   }
   if (mrc->input){
     free(mrc->input);
+    mrc->input = NULL;
   }
   if (mrc->buffer){
     free(mrc->buffer);
+    mrc->buffer = NULL;
   }
   if (mrc->output){
     free(mrc->output);
+    mrc->output = NULL;
+  }
+  if (mrc->packed){
+    munmap(mrc->packed, mrc->length);
+    mrc->packed = NULL;
+  }
+  if (mrc->sum){
+    free(mrc->sum);
+    mrc->sum = NULL;
+  }
+  if (mrc->grp){
+    free(mrc->grp);
+    mrc->grp = NULL;
   }
   return;
 }
 
-int write_mrc(_mrc* mrc, char *filename){
-  // Writes 4-bit MRC file given an mrc structure and data
+void write_header(_mrc *mrc, FILE *file){
+  // Output standard MRC header fields to file
+  fwrite(&mrc->n_crs,      4, 3,   file);
+  fwrite(&mrc->mode,       4, 1,   file);
+  fwrite(&mrc->start_crs,  4, 3,   file);
+  fwrite(&mrc->n_xyz,      4, 3,   file);
+  fwrite(&mrc->length_xyz, 4, 3,   file);
+  fwrite(&mrc->angle_xyz,  4, 3,   file);
+  fwrite(&mrc->map_crs,    4, 3,   file);
+  fwrite(&mrc->d_min,      4, 1,   file);
+  fwrite(&mrc->d_max,      4, 1,   file);
+  fwrite(&mrc->d_mean,     4, 1,   file);
+  fwrite(&mrc->ispg,       4, 1,   file);
+  fwrite(&mrc->nsymbt,     4, 1,   file);
+  fwrite(&mrc->extra,      4, 25,  file);
+  fwrite(&mrc->ori_xyz,    4, 3,   file);
+  fwrite(&mrc->map,        1, 4,   file);
+  fwrite(&mrc->machst,     1, 4,   file);
+  fwrite(&mrc->rms,        4, 1,   file);
+  fwrite(&mrc->nlabl,      4, 1,   file);
+  fwrite(&mrc->label,      1, 800, file);
+  return;
+}
+
+int write_mrc(_mrc* mrc, _opt *opt, char *filename){
+  // Writes 4-bit or binned 8-bit MRC file given an mrc structure and data
   // Header values are set to placeholders for speed
-  int32_t dim_4b0 = (mrc->n_crs[0] / 2) + (mrc->n_crs[0] % 2);
-  mrc->length_xyz[0] = 2 * dim_4b0 * (mrc->length_xyz[0] / ((float) mrc->n_xyz[0]));
-  mrc->n_crs[0] = 2 * dim_4b0;
-  mrc->n_xyz[0] = 2 * dim_4b0;
-  mrc->mode   =  101;
+  int32_t n_x = mrc->n_crs[0] / opt->bin;
+  int32_t n_y = mrc->n_crs[1] / opt->bin;
+  int32_t dim_4b0 = (n_x / 2) + (n_x % 2);
+  int32_t dim_out = (opt->bits == 8 ? n_x : dim_4b0);
+  int64_t bytes = (int64_t) dim_out * n_y * mrc->n_crs[2];
+  mrc->length_xyz[0] = (opt->bits == 8 ? n_x : 2 * dim_4b0) * opt->bin * (mrc->length_xyz[0] / ((float) mrc->n_xyz[0]));
+  mrc->n_crs[0] = (opt->bits == 8 ? n_x : 2 * dim_4b0);
+  mrc->n_xyz[0] = (opt->bits == 8 ? n_x : 2 * dim_4b0);
+  if (opt->bin > 1){
+    mrc->length_xyz[1] = n_y * opt->bin * (mrc->length_xyz[1] / ((float) mrc->n_xyz[1]));
+    mrc->n_crs[1] = n_y;
+    mrc->n_xyz[1] = n_y;
+  }
+  mrc->mode   = (opt->bits == 8 ?   0 : 101);
+  mrc->nsymbt =    0;
   mrc->d_min  =  0.0;
-  mrc->d_max  = 16.0;
+  mrc->d_max  = (opt->bits == 8 ? 127.0 : 16.0);
   mrc->d_mean =  1.0;
   mrc->rms    =  4.0;
   // Output header to file
@@ -156,35 +311,22 @@ int write_mrc(_mrc* mrc, char *filename){
     fprintf(stderr, "\n\t Error writing output - bad file handle\n");
     return 1;
   }
-  fwrite(&mrc->n_crs,      4, 3,   mrc->file);
-  fwrite(&mrc->mode,       4, 1,   mrc->file);
-  fwrite(&mrc->start_crs,  4, 3,   mrc->file);
-  fwrite(&mrc->n_xyz,      4, 3,   mrc->file);
-  fwrite(&mrc->length_xyz, 4, 3,   mrc->file);
-  fwrite(&mrc->angle_xyz,  4, 3,   mrc->file);
-  fwrite(&mrc->map_crs,    4, 3,   mrc->file);
-  fwrite(&mrc->d_min,      4, 1,   mrc->file);
-  fwrite(&mrc->d_max,      4, 1,   mrc->file);
-  fwrite(&mrc->d_mean,     4, 1,   mrc->file);
-  fwrite(&mrc->ispg,       4, 1,   mrc->file);
-  fwrite(&mrc->nsymbt,     4, 1,   mrc->file);
-  fwrite(&mrc->extra,      4, 25,  mrc->file);
-  fwrite(&mrc->ori_xyz,    4, 3,   mrc->file);
-  fwrite(&mrc->map,        1, 4,   mrc->file);
-  fwrite(&mrc->machst,     1, 4,   mrc->file);
-  fwrite(&mrc->rms,        4, 1,   mrc->file);
-  fwrite(&mrc->nlabl,      4, 1,   mrc->file);
-  fwrite(&mrc->label,      1, 800, mrc->file);
+  write_header(mrc, mrc->file);
+  // Checksum bytes as written
+  if (mrc->hash){
+    mrc->crc_w   = crc32c(0, mrc, 1024);
+    mrc->crc_w   = crc32c(mrc->crc_w, mrc->output, (size_t) bytes);
+    mrc->bytes_w = 1024 + bytes;
+  }
   // Output data to file
-  if (fwrite(mrc->output, sizeof(int8_t), dim_4b0 * mrc->n_crs[1] * mrc->n_crs[2], mrc->file) == dim_4b0 * mrc->n_crs[1] * mrc->n_crs[2]){
+  if (fwrite(mrc->output, sizeof(int8_t), (size_t) bytes, mrc->file) == (size_t) bytes){
     return 0;
   }
   return 1;
 }
 
-double *read_raw(char *filename){
-  // Output data to file
-  int64_t size;
+double *read_raw(char *filename, int64_t *size){
+  // Read raw gain and the number of pixels stored with it
   FILE *file = NULL;
   file = fopen(filename, "rb");
   if (!file){
@@ -192,9 +334,15 @@ double *read_raw(char *filename){
     fclose(file);
     exit(1);
   }
-  fread(&size, sizeof(int64_t),  1, file);
-  double *gain = malloc((size_t) size * sizeof(double));
-  fread(gain, sizeof(double), (size_t) size, file);
+  if (fread(size, sizeof(int64_t),  1, file) != 1 || *size <= 0){
+    printf("\t Error reading %s - no gain size\n", filename);
+    exit(1);
+  }
+  double *gain = malloc((size_t) *size * sizeof(double));
+  if (!gain || fread(gain, sizeof(double), (size_t) *size, file) != (size_t) *size){
+    printf("\t Error reading %s - gain truncated\n", filename);
+    exit(1);
+  }
   fclose(file);
   return gain;
 }
@@ -210,48 +358,18 @@ void write_raw(double* gain, char *filename, int64_t size){
   }
   fwrite(&size, sizeof(int64_t),  1, file);
   fwrite(gain, sizeof(double), size, file);
+  fclose(file);
   return;
 }
 
 void gain_mrc(double* gain, char *filename, int64_t size, _mrc *mrc){
   // Output gain data to mrc file
   int32_t i;
-  // Header values are set to placeholders for speed
-  mrc->n_crs[2] = 1;
-  mrc->n_xyz[2] = 1;
-  mrc->mode   =   2;
-  mrc->d_min  = 0.0;
-  mrc->d_max  = 2.0;
-  mrc->d_mean = 1.0;
-  mrc->rms    = 0.1;
-  // Output header to file
-  fclose(mrc->file);
-  mrc->file = fopen(filename, "wb");
-  if (!mrc->file){
-    fprintf(stderr, "\n\t Error writing output - bad file handle\n");
+  float *tmp = malloc(size * sizeof(float));
+  if (!tmp){
+    fprintf(stderr, "\n\t Error writing output - no memory allocated\n");
     return;
   }
-  fwrite(&mrc->n_crs,      4, 3,   mrc->file);
-  fwrite(&mrc->mode,       4, 1,   mrc->file);
-  fwrite(&mrc->start_crs,  4, 3,   mrc->file);
-  fwrite(&mrc->n_xyz,      4, 3,   mrc->file);
-  fwrite(&mrc->length_xyz, 4, 3,   mrc->file);
-  fwrite(&mrc->angle_xyz,  4, 3,   mrc->file);
-  fwrite(&mrc->map_crs,    4, 3,   mrc->file);
-  fwrite(&mrc->d_min,      4, 1,   mrc->file);
-  fwrite(&mrc->d_max,      4, 1,   mrc->file);
-  fwrite(&mrc->d_mean,     4, 1,   mrc->file);
-  fwrite(&mrc->ispg,       4, 1,   mrc->file);
-  fwrite(&mrc->nsymbt,     4, 1,   mrc->file);
-  fwrite(&mrc->extra,      4, 25,  mrc->file);
-  fwrite(&mrc->ori_xyz,    4, 3,   mrc->file);
-  fwrite(&mrc->map,        1, 4,   mrc->file);
-  fwrite(&mrc->machst,     1, 4,   mrc->file);
-  fwrite(&mrc->rms,        4, 1,   mrc->file);
-  fwrite(&mrc->nlabl,      4, 1,   mrc->file);
-  fwrite(&mrc->label,      1, 800, mrc->file);
-  // Output data to file
-  float *tmp = malloc(size * sizeof(float));
   for (i = 0; i < size; i++){
     if (!isfinite((float) gain[i]) || (float) gain[i] == 0.0){
       tmp[i] = 1.0;
@@ -261,6 +379,49 @@ void gain_mrc(double* gain, char *filename, int64_t size, _mrc *mrc){
       tmp[i] = (float) gain[i];
     }
   }
-  fwrite(tmp, sizeof(float), size, mrc->file);
+  // Header is copied from the stack so it is not altered for output
+  if (write_map(mrc, filename, tmp, 2, 1)){
+    fprintf(stderr, "\n\t Error writing output - bad file handle\n");
+  }
+  free(tmp);
   return;
 }
+
+int write_map(_mrc *mrc, char *filename, void *data, int32_t mode, int32_t n_z){
+  // Writes mode 1 (int16) or mode 2 (float) MRC file of n_z sections
+  // Header values are copied from the stack currently being packed
+  int64_t i, size;
+  double val, sum = 0.0;
+  FILE *file = NULL;
+  _mrc map = *mrc;
+  size = (int64_t) map.n_crs[0] * map.n_crs[1] * n_z;
+  map.length_xyz[2] = n_z * (map.length_xyz[2] / ((float) map.n_xyz[2]));
+  map.n_crs[2] = n_z;
+  map.n_xyz[2] = n_z;
+  map.mode     = mode;
+  map.nsymbt   = 0;
+  map.d_min    = FLT_MAX;
+  map.d_max    = -FLT_MAX;
+  // Range and mean of the integer sums for display
+  for (i = 0; i < size; i++){
+    val = (mode == 1 ? ((int16_t*) data)[i] : ((float*) data)[i]);
+    map.d_min = (val < map.d_min ? val : map.d_min);
+    map.d_max = (val > map.d_max ? val : map.d_max);
+    sum += val;
+  }
+  map.d_mean = sum / (double) size;
+  map.rms    = 0.0;
+  // Output header and data to file
+  file = fopen(filename, "wb");
+  if (!file){
+    fprintf(stderr, "\n\t Error writing output - bad file handle\n");
+    return 1;
+  }
+  write_header(&map, file);
+  if (fwrite(data, (mode == 1 ? sizeof(int16_t) : sizeof(float)), size, file) != (size_t) size){
+    fclose(file);
+    return 1;
+  }
+  fclose(file);
+  return 0;
+}